@@ -0,0 +1,236 @@
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+// ループバックTCPとUNIXドメインソケットの往復時間を比較するベンチマーク
+// サーバ(server.out)に1行送信し、":OK\r\n"の応答を受信するまでを1往復として計測する
+//   bench.out count localhost:5000 unix:/tmp/server.sock unix:@server
+// サーバは標準エラーに受信行を出力するので、計測時は 2>/dev/null で起動する
+
+// 1往復で送信する行
+#define BENCH_LINE "bench\n"
+
+// UNIXドメインソケットのエンドポイント指定の接頭辞
+// "unix:/path" はファイルシステム上のパス、"unix:@name" はLinuxの抽象名前空間
+#define UNIX_PREFIX "unix:"
+
+// UNIXドメインソケットのエンドポイント指定かどうか
+int is_unix_endpoint(const char *endpoint) {
+  return (strncmp(endpoint, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0);
+}
+
+// "unix:..." からUNIXドメインソケットのアドレスを作成
+int unix_sockaddr(const char *endpoint, struct sockaddr_un *addr, socklen_t *addr_len) {
+  const char *path;
+  size_t path_len;
+
+  path = endpoint + strlen(UNIX_PREFIX);
+  path_len = strlen(path);
+  // sun_pathに収まらないパスはエラー(終端の'\0'の分も考慮)
+  if (path_len == 0 || path_len >= sizeof(addr->sun_path)) {
+    (void) fprintf(stderr, "unix_sockaddr():invalid path:%s\n", path);
+    return (-1);
+  }
+
+  (void) memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (path[0] == '@') {
+#ifdef __linux__
+    // 抽象名前空間ではsun_pathの先頭を'\0'にし、名前の長さ分だけをアドレス長に含める
+    (void) memcpy(addr->sun_path + 1, path + 1, path_len - 1);
+    *addr_len = (socklen_t) (offsetof(struct sockaddr_un, sun_path) + path_len);
+#else
+    (void) fprintf(stderr, "unix_sockaddr():abstract namespace is not supported\n");
+    return (-1);
+#endif
+  } else {
+    (void) memcpy(addr->sun_path, path, path_len);
+    *addr_len = (socklen_t) (offsetof(struct sockaddr_un, sun_path) + path_len + 1);
+  }
+  return (0);
+}
+
+// Socket connection to UNIX domain server
+int client_socket_unix(const char *endpoint) {
+  struct sockaddr_un addr;
+  socklen_t addr_len;
+  int soc;
+
+  if (unix_sockaddr(endpoint, &addr, &addr_len) == -1) {
+    return (-1);
+  }
+  (void) fprintf(stderr, "path=%s\n", endpoint + strlen(UNIX_PREFIX));
+
+  // create a socket
+  if ((soc = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+    perror("socket");
+    return (-1);
+  }
+  // connect to the socket-server
+  if (connect(soc, (struct sockaddr *) &addr, addr_len) == -1) {
+    perror("connect");
+    (void) close(soc);
+    return (-1);
+  }
+  return (soc);
+}
+
+// Socket connection to server
+// hostnmが "unix:..." の場合はUNIXドメインソケットで接続する(portnmは使わない)
+int client_socket(const char *hostnm, const char *portnm) {
+  char nbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+  struct addrinfo hints, *res0;
+  int soc, errcode;
+
+  if (is_unix_endpoint(hostnm)) {
+    return (client_socket_unix(hostnm));
+  }
+
+  // Reset addrinfo
+  (void) memset(&hints, 0, sizeof(hints));
+  // ソケットサーバとは違って、ai_flagsを設定しない
+  // IPV4をつかってsocket type にストリームを設定するのみ
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+
+  // Set the addrinfo
+  // 明示的に接続先のIPアドレス、ホスト名を指定する必要があるため、hostnm指定
+  if ((errcode = getaddrinfo(hostnm, portnm, &hints, &res0)) != 0) {
+    (void) fprintf(stderr, "getaddrinfo():%s\n", gai_strerror(errcode));
+    return (-1);
+  }
+  if ((errcode = getnameinfo(res0->ai_addr, res0->ai_addrlen,
+                              nbuf, sizeof(nbuf),
+                              sbuf, sizeof(sbuf),
+                              NI_NUMERICHOST | NI_NUMERICSERV)) != 0) {
+    (void) fprintf(stderr, "getnameinfo():%s\n", gai_strerror(errcode));
+    freeaddrinfo(res0);
+    return (-1);
+  }
+  (void) fprintf(stderr, "addr=%s\n", nbuf);
+  (void) fprintf(stderr, "port=%s\n", sbuf);
+
+  // create a socket
+  if ((soc = socket(res0->ai_family, res0->ai_socktype, res0->ai_protocol)) == -1) {
+    perror("socket");
+    freeaddrinfo(res0);
+    return (-1);
+  }
+  // connect to the socket-server
+  if (connect(soc, res0->ai_addr, res0->ai_addrlen) == -1) {
+    perror("connect");
+    (void) close(soc);
+    freeaddrinfo(res0);
+    return (-1);
+  }
+  freeaddrinfo(res0);
+  return (soc);
+}
+
+// 1行分の応答を受信
+int recv_line(int soc) {
+  char buf[512];
+  ssize_t len;
+
+  for (;;) {
+    if ((len = recv(soc, buf, sizeof(buf), 0)) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("recv");
+      return (-1);
+    }
+    if (len == 0) {
+      (void) fprintf(stderr, "recv:EOF\n");
+      return (-1);
+    }
+    // 送信は1行ずつ応答を待つので、改行が来た時点で1往復完了
+    if (buf[len - 1] == '\n') {
+      return (0);
+    }
+  }
+}
+
+// エンドポイントに接続してcount回往復し、結果を表示
+// endpointは "host:port" または "unix:..."
+int bench_endpoint(const char *endpoint, long count) {
+  char hbuf[NI_MAXHOST], *port;
+  struct timespec start, end;
+  double sec;
+  long i;
+  int soc;
+
+  if (is_unix_endpoint(endpoint)) {
+    soc = client_socket(endpoint, "");
+  } else {
+    (void) snprintf(hbuf, sizeof(hbuf), "%s", endpoint);
+    if ((port = strrchr(hbuf, ':')) == NULL) {
+      (void) fprintf(stderr, "bench_endpoint():invalid endpoint:%s\n", endpoint);
+      return (-1);
+    }
+    *port++ = '\0';
+    soc = client_socket(hbuf, port);
+  }
+  if (soc == -1) {
+    (void) fprintf(stderr, "client_socket(%s):error\n", endpoint);
+    return (-1);
+  }
+
+  (void) clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < count; i++) {
+    if (send(soc, BENCH_LINE, strlen(BENCH_LINE), 0) == -1) {
+      perror("send");
+      (void) close(soc);
+      return (-1);
+    }
+    if (recv_line(soc) == -1) {
+      (void) close(soc);
+      return (-1);
+    }
+  }
+  (void) clock_gettime(CLOCK_MONOTONIC, &end);
+  (void) close(soc);
+
+  sec = (double) (end.tv_sec - start.tv_sec)
+      + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+  (void) printf("%-24s %8ld round trips %8.3f sec %8.2f us/rtt %10.0f rtt/sec\n",
+                endpoint, count, sec, sec * 1e6 / (double) count, (double) count / sec);
+  return (0);
+}
+
+int main(int argc, char *argv[]) {
+  long count;
+  int i, ret;
+
+  // 引数に回数とエンドポイントが指定されているかチェック
+  if (argc <= 2) {
+    (void) fprintf(stderr, "bench count host:port|unix:/path|unix:@name ...\n");
+    return (EX_USAGE);
+  }
+  if ((count = strtol(argv[1], NULL, 10)) <= 0) {
+    (void) fprintf(stderr, "bench:invalid count:%s\n", argv[1]);
+    return (EX_USAGE);
+  }
+
+  ret = EX_OK;
+  for (i = 2; i < argc; i++) {
+    if (bench_endpoint(argv[i], count) == -1) {
+      ret = EX_UNAVAILABLE;
+    }
+  }
+  return (ret);
+}
@@ -1,6 +1,7 @@
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
 #include <arpa/inet.h>
@@ -9,19 +10,104 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
+#include <time.h>
 #include <unistd.h>
 
+// UNIXドメインソケットのエンドポイント指定の接頭辞
+// "unix:/path" はファイルシステム上のパス、"unix:@name" はLinuxの抽象名前空間
+#define UNIX_PREFIX "unix:"
+
+// 受信記録ファイルの形式(server.cと同じ)
+// 先頭にCAPTURE_MAGIC、以降はレコードの並び(数値はネットワークバイトオーダー)
+//   type(1) conn(4) usec(8) len(4) payload(len)
+// typeは接続(CAPTURE_OPEN)、受信行(CAPTURE_LINE)、切断(CAPTURE_CLOSE)
+// connは接続ごとの通し番号、usecは記録開始からの経過マイクロ秒
+#define CAPTURE_MAGIC "SOCKCAP1"
+#define CAPTURE_HDR_SIZE 17
+#define CAPTURE_OPEN 'O'
+#define CAPTURE_LINE 'L'
+#define CAPTURE_CLOSE 'C'
+
+// UNIXドメインソケットのエンドポイント指定かどうか
+int is_unix_endpoint(const char *endpoint) {
+  return (strncmp(endpoint, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0);
+}
+
+// "unix:..." からUNIXドメインソケットのアドレスを作成
+int unix_sockaddr(const char *endpoint, struct sockaddr_un *addr, socklen_t *addr_len) {
+  const char *path;
+  size_t path_len;
+
+  path = endpoint + strlen(UNIX_PREFIX);
+  path_len = strlen(path);
+  // sun_pathに収まらないパスはエラー(終端の'\0'の分も考慮)
+  if (path_len == 0 || path_len >= sizeof(addr->sun_path)) {
+    (void) fprintf(stderr, "unix_sockaddr():invalid path:%s\n", path);
+    return (-1);
+  }
+
+  (void) memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (path[0] == '@') {
+#ifdef __linux__
+    // 抽象名前空間ではsun_pathの先頭を'\0'にし、名前の長さ分だけをアドレス長に含める
+    (void) memcpy(addr->sun_path + 1, path + 1, path_len - 1);
+    *addr_len = (socklen_t) (offsetof(struct sockaddr_un, sun_path) + path_len);
+#else
+    (void) fprintf(stderr, "unix_sockaddr():abstract namespace is not supported\n");
+    return (-1);
+#endif
+  } else {
+    (void) memcpy(addr->sun_path, path, path_len);
+    *addr_len = (socklen_t) (offsetof(struct sockaddr_un, sun_path) + path_len + 1);
+  }
+  return (0);
+}
+
+// Socket connection to UNIX domain server
+int client_socket_unix(const char *endpoint) {
+  struct sockaddr_un addr;
+  socklen_t addr_len;
+  int soc;
+
+  if (unix_sockaddr(endpoint, &addr, &addr_len) == -1) {
+    return (-1);
+  }
+  (void) fprintf(stderr, "path=%s\n", endpoint + strlen(UNIX_PREFIX));
+
+  // create a socket
+  if ((soc = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+    perror("socket");
+    return (-1);
+  }
+  // connect to the socket-server
+  if (connect(soc, (struct sockaddr *) &addr, addr_len) == -1) {
+    perror("connect");
+    (void) close(soc);
+    return (-1);
+  }
+  return (soc);
+}
+
 // Socket connection to server
+// hostnmが "unix:..." の場合はUNIXドメインソケットで接続する(portnmは使わない)
 int client_socket(const char *hostnm, const char *portnm) {
   char nbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
   struct addrinfo hints, *res0;
   int soc, errcode;
 
+  if (is_unix_endpoint(hostnm)) {
+    return (client_socket_unix(hostnm));
+  }
+
   // Reset addrinfo
   (void) memset(&hints, 0, sizeof(hints));
   // ソケットサーバとは違って、ai_flagsを設定しない
@@ -103,7 +189,7 @@ void send_recv_loop(int soc) {
         // socket ready
         if (FD_ISSET(soc, &ready)) {
           // 受信
-          if ((len == recv(soc, buf, sizeof(buf), 0)) == -1) {
+          if ((len = recv(soc, buf, sizeof(buf) - 1, 0)) == -1) {
             // error
             perror("recv");
             end = 1;
@@ -146,15 +232,340 @@ void send_recv_loop(int soc) {
   }
 }
 
-int main(int argc, char *argv[]) {
+// 記録の再生
+// server.outの受信記録ファイルを読み、記録どおりのタイミングで接続・送信・切断を再現する
+// speedは再生速度の倍率(1で記録どおり、2で2倍速、0で待ち時間なし)
+// 応答は読み捨てる。読まずにいるとサーバ側の出力キューが溜まり受信を止められてしまうため
+
+// 再生中の接続
+struct replay_conn {
+  uint32_t id;  // 記録上の接続番号
   int soc;
+  int closing;  // 記録上は切断済み。サーバからのEOFを待っている
+};
+
+struct replay_conn replay_tbl[FD_SETSIZE];
+int replay_num;
+size_t replay_recv_bytes;
+
+// 経過時間計測用の現在時刻(マイクロ秒)
+uint64_t now_usec(void) {
+  struct timespec ts;
+
+  (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000);
+}
+
+// 記録上の接続番号から再生中の接続を探す
+int replay_find(uint32_t id) {
+  int i;
+
+  for (i = 0; i < replay_num; i++) {
+    if (replay_tbl[i].id == id) {
+      return (i);
+    }
+  }
+  return (-1);
+}
+
+// 再生中の接続を表から外してクローズ
+void replay_remove(int i) {
+  (void) close(replay_tbl[i].soc);
+  replay_tbl[i] = replay_tbl[--replay_num];
+}
+
+// 全接続の応答を読み捨てる
+// timeoutはマイクロ秒(-1で無期限)。wsocが0以上ならその書き込み可能も待ち、書き込み可能なら1を返す
+int replay_pump(int64_t timeout, int wsoc) {
+  char buf[4096];
+  struct timeval tv;
+  fd_set rmask, wmask;
+  ssize_t len;
+  int width, i, ret;
+
+  FD_ZERO(&rmask);
+  FD_ZERO(&wmask);
+  width = 0;
+  for (i = 0; i < replay_num; i++) {
+    FD_SET(replay_tbl[i].soc, &rmask);
+    if (replay_tbl[i].soc + 1 > width) {
+      width = replay_tbl[i].soc + 1;
+    }
+  }
+  if (wsoc >= 0) {
+    FD_SET(wsoc, &wmask);
+    if (wsoc + 1 > width) {
+      width = wsoc + 1;
+    }
+  }
+  if (width == 0 && timeout < 0) {
+    return (0);
+  }
+  if (timeout >= 0) {
+    tv.tv_sec = (time_t) (timeout / 1000000);
+    tv.tv_usec = (suseconds_t) (timeout % 1000000);
+  }
+
+  if ((ret = select(width, &rmask, &wmask, NULL, timeout >= 0 ? &tv : NULL)) == -1) {
+    if (errno == EINTR) {
+      return (0);
+    }
+    perror("select");
+    return (-1);
+  }
+  if (ret == 0) {
+    return (0);
+  }
+
+  // 表から外すと詰められるので後ろから見る
+  for (i = replay_num - 1; i >= 0; i--) {
+    if (!FD_ISSET(replay_tbl[i].soc, &rmask)) {
+      continue;
+    }
+    if ((len = recv(replay_tbl[i].soc, buf, sizeof(buf), 0)) == -1) {
+      if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+        continue;
+      }
+      perror("recv");
+      replay_remove(i);
+    } else if (len == 0) {
+      if (!replay_tbl[i].closing) {
+        (void) fprintf(stderr, "replay:conn %u:closed by server\n",
+                       (unsigned) replay_tbl[i].id);
+      }
+      replay_remove(i);
+    } else {
+      replay_recv_bytes += (size_t) len;
+    }
+  }
+  return (wsoc >= 0 && FD_ISSET(wsoc, &wmask) ? 1 : 0);
+}
+
+// 記録上の接続番号idの接続に1行送信
+// 送信できない間は全接続の応答を読み捨てながら書き込み可能を待つ
+// 待っている間にその接続がサーバから切られて表から外れることがあるので、
+// 表の位置は覚えておかずに毎回接続番号で探し直す
+// 送信できなかった場合は-1を返す(接続は表から外れている)
+int replay_send(uint32_t id, const char *data, size_t len) {
+  ssize_t n;
+  int i;
+
+  while (len > 0) {
+    if ((i = replay_find(id)) == -1) {
+      return (-1);
+    }
+    if ((n = send(replay_tbl[i].soc, data, len, 0)) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (replay_pump(-1, replay_tbl[i].soc) == -1) {
+          return (-1);
+        }
+        continue;
+      }
+      perror("send");
+      replay_remove(i);
+      return (-1);
+    }
+    data += n;
+    len -= (size_t) n;
+  }
+  return (0);
+}
+
+// 記録ファイルを再生
+int replay(const char *path, double speed, const char *hostnm, const char *portnm) {
+  char magic[sizeof(CAPTURE_MAGIC) - 1], line[65536];
+  unsigned char hdr[CAPTURE_HDR_SIZE];
+  uint64_t start, due, usec, now;
+  uint32_t id, len, n, conns, lines, failed;
+  size_t sent, rlen;
+  FILE *fp;
+  int i, soc, flags, ret;
+
+  if ((fp = fopen(path, "rb")) == NULL) {
+    perror("fopen");
+    return (-1);
+  }
+  if (fread(magic, sizeof(magic), 1, fp) != 1
+      || memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0) {
+    (void) fprintf(stderr, "replay:%s:not a capture file\n", path);
+    (void) fclose(fp);
+    return (-1);
+  }
+
+  ret = 0;
+  conns = lines = failed = 0;
+  sent = 0;
+  usec = 0;
+  start = now_usec();
+  // ヘッダ単位ではなくバイト単位で読み、ヘッダの途中で終わった記録を正常な終わりと区別する
+  while ((rlen = fread(hdr, 1, sizeof(hdr), fp)) == sizeof(hdr)) {
+    (void) memcpy(&n, hdr + 1, 4);
+    id = ntohl(n);
+    (void) memcpy(&n, hdr + 5, 4);
+    usec = (uint64_t) ntohl(n) << 32;
+    (void) memcpy(&n, hdr + 9, 4);
+    usec |= ntohl(n);
+    (void) memcpy(&n, hdr + 13, 4);
+    len = ntohl(n);
+    if (len > sizeof(line) || (len > 0 && fread(line, len, 1, fp) != 1)) {
+      (void) fprintf(stderr, "replay:%s:broken record\n", path);
+      ret = -1;
+      break;
+    }
+
+    // 記録時刻まで応答を読み捨てながら待つ(速度0でも溜まった応答は読む)
+    due = start + (speed > 0 ? (uint64_t) ((double) usec / speed) : 0);
+    do {
+      now = now_usec();
+      if (replay_pump(due > now ? (int64_t) (due - now) : 0, -1) == -1) {
+        ret = -1;
+        break;
+      }
+    } while (now_usec() < due);
+    if (ret == -1) {
+      break;
+    }
+
+    switch (hdr[0]) {
+      case CAPTURE_OPEN:
+        if (replay_num >= FD_SETSIZE) {
+          (void) fprintf(stderr, "replay:conn %u:too many connections\n", (unsigned) id);
+          failed++;
+          break;
+        }
+        if ((soc = client_socket(hostnm, portnm)) == -1) {
+          (void) fprintf(stderr, "replay:conn %u:client_socket():error\n", (unsigned) id);
+          failed++;
+          break;
+        }
+        // 応答の読み捨てで他の接続の再生が止まらないようにノンブロッキングにする
+        if (soc >= FD_SETSIZE || (flags = fcntl(soc, F_GETFL, 0)) == -1
+            || fcntl(soc, F_SETFL, flags | O_NONBLOCK) == -1) {
+          (void) fprintf(stderr, "replay:conn %u:cannot use socket\n", (unsigned) id);
+          (void) close(soc);
+          failed++;
+          break;
+        }
+        replay_tbl[replay_num].id = id;
+        replay_tbl[replay_num].soc = soc;
+        replay_tbl[replay_num].closing = 0;
+        replay_num++;
+        conns++;
+        break;
+      case CAPTURE_LINE:
+        if ((i = replay_find(id)) == -1 || replay_tbl[i].closing) {
+          break;
+        }
+        if (replay_send(id, line, len) == -1) {
+          break;
+        }
+        lines++;
+        sent += len;
+        break;
+      case CAPTURE_CLOSE:
+        // 送信側だけ閉じ、残りの応答はサーバのEOFまで読む
+        if ((i = replay_find(id)) != -1 && !replay_tbl[i].closing) {
+          (void) shutdown(replay_tbl[i].soc, SHUT_WR);
+          replay_tbl[i].closing = 1;
+        }
+        break;
+      default:
+        (void) fprintf(stderr, "replay:%s:unknown record type %d\n", path, hdr[0]);
+        ret = -1;
+        break;
+    }
+    if (ret == -1) {
+      break;
+    }
+  }
+  // サーバが書き込み途中で止まった記録はヘッダの途中で終わることがある
+  if (ret == 0 && ferror(fp)) {
+    (void) fprintf(stderr, "replay:%s:read error\n", path);
+    ret = -1;
+  } else if (ret == 0 && rlen != 0) {
+    (void) fprintf(stderr, "replay:%s:broken record\n", path);
+    ret = -1;
+  }
+  (void) fclose(fp);
+
+  // 記録が切断前に終わっている接続も閉じ、全接続のEOFを待つ
+  for (i = 0; i < replay_num; i++) {
+    if (!replay_tbl[i].closing) {
+      (void) shutdown(replay_tbl[i].soc, SHUT_WR);
+      replay_tbl[i].closing = 1;
+    }
+  }
+  while (replay_num > 0) {
+    if (replay_pump(-1, -1) == -1) {
+      ret = -1;
+      break;
+    }
+  }
+  while (replay_num > 0) {
+    replay_remove(replay_num - 1);
+  }
+
+  (void) fprintf(stderr, "replay:conns=%u failed=%u lines=%u sent=%zu recv=%zu recorded=%.3f sec elapsed=%.3f sec\n",
+                 (unsigned) conns, (unsigned) failed, (unsigned) lines, sent, replay_recv_bytes,
+                 (double) usec / 1e6, (double) (now_usec() - start) / 1e6);
+  // 記録どおりに接続できなかった再生は回帰テストとして失敗扱い
+  if (failed > 0) {
+    ret = -1;
+  }
+  return (ret);
+}
+
+int main(int argc, char *argv[]) {
+  const char *replay_file = NULL;
+  char *end;
+  double speed = 1.0;
+  int soc, c;
+
+  // -r 記録ファイル: 対話の代わりに記録を再生する
+  // -s 倍率: 再生速度(0で待ち時間なし)
+  while ((c = getopt(argc, argv, "r:s:")) != -1) {
+    switch (c) {
+      case 'r':
+        replay_file = optarg;
+        break;
+      case 's':
+        // "-s fast" のような指定を0(待ち時間なし)と取り違えないように数値以外はエラー
+        speed = strtod(optarg, &end);
+        if (end == optarg || *end != '\0') {
+          (void) fprintf(stderr, "client:invalid speed:%s\n", optarg);
+          return (EX_USAGE);
+        }
+        break;
+      default:
+        argc = 0;
+        break;
+    }
+  }
+  argc -= optind;
+  argv += optind;
+
   // 引数にホスト名・ポート番号が指定されているかチェック
-  if (argc <= 2) {
-    (void) fprintf(stderr, "client server-host port \n");
+  // UNIXドメインソケットの場合はパスのみ指定する
+  if (argc <= 0 || (argc <= 1 && !is_unix_endpoint(argv[0])) || speed < 0) {
+    (void) fprintf(stderr, "client [-r capture-file [-s speed]] server-host port|unix:/path|unix:@name\n");
     return (EX_USAGE);
   }
+
+  if (replay_file != NULL) {
+    // 切断済みの接続へのsend()でSIGPIPEによって終了しないようにする
+    (void) signal(SIGPIPE, SIG_IGN);
+    if (replay(replay_file, speed, argv[0], argc > 1 ? argv[1] : "") == -1) {
+      (void) fprintf(stderr, "replay(%s):error\n", replay_file);
+      return (EX_DATAERR);
+    }
+    return (EX_OK);
+  }
+
   // Try socket connection to server
-  if ((soc = client_socket(argv[1], argv[2])) == -1) {
+  if ((soc = client_socket(argv[0], argc > 1 ? argv[1] : "")) == -1) {
     (void) fprintf(stderr, "client_socket():error\n");
     return (EX_UNAVAILABLE);
   }
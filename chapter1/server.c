@@ -1,6 +1,11 @@
+// struct ucred(SO_PEERCRED)を使うため
+#define _GNU_SOURCE
+
 #include <sys/param.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
 #include <arpa/inet.h>
@@ -9,12 +14,84 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
+#include <time.h>
 #include <unistd.h>
 
+// UNIXドメインソケットのエンドポイント指定の接頭辞
+// "unix:/path" はファイルシステム上のパス、"unix:@name" はLinuxの抽象名前空間
+#define UNIX_PREFIX "unix:"
+
+// 接続元の資格情報(UNIXドメインソケットのみ取得可能)
+struct peer_cred {
+  pid_t pid;
+  uid_t uid;
+  gid_t gid;
+};
+
+// 出力キューのバッファ1つあたりのサイズ
+#define OUT_BUF_SIZE 4096
+// 出力キューがこのバイト数を超えたらそのクライアントからの受信を止め、
+// 送信が進んでLOW_WATER以下になったら受信を再開する
+#define OUT_HIGH_WATER (64 * 1024)
+#define OUT_LOW_WATER (16 * 1024)
+
+// 出力キューを構成するバッファ(チェーン)
+struct out_buf {
+  struct out_buf *next;
+  size_t off;  // 送信済みの位置
+  size_t len;  // 書き込み済みの長さ
+  char data[OUT_BUF_SIZE];
+};
+
+// 接続ごとの状態
+struct conn {
+  int acc;
+  uint32_t id;  // 受信記録での接続番号
+  struct peer_cred cred;
+  int has_cred;
+  char in[512];  // 受信バッファ(改行までを1行として切り出す)
+  size_t in_len;
+  // 受信記録用の最後にrecv()した時刻
+  // 受信停止中はrecv()しないので、受信バッファ中の完結した行はすべてこの時刻に届いたもの
+  uint64_t in_usec;
+  struct out_buf *out_head, *out_tail;
+  size_t out_len;  // 出力キュー中の未送信バイト数
+  int paused;  // HIGH_WATERを超えて受信停止中
+  int eof;  // クライアントが送信を終えた。出力キューを送り切ったらクローズする
+};
+
+// ディスクリプタ番号をインデックスとした接続テーブル
+struct conn *conn_tbl[FD_SETSIZE];
+
+// 受信記録ファイルの形式
+// 先頭にCAPTURE_MAGIC、以降はレコードの並び(数値はネットワークバイトオーダー)
+//   type(1) conn(4) usec(8) len(4) payload(len)
+// typeは接続(CAPTURE_OPEN)、受信行(CAPTURE_LINE)、切断(CAPTURE_CLOSE)
+// connは接続ごとの通し番号、usecは記録開始からの経過マイクロ秒
+// 受信行のusecは行を処理した時刻ではなく、その行の改行をrecv()で受信した時刻
+// (出力キューが溜まって受信を止めている間の待ちを、クライアントの送信間隔として記録しないため)
+// ただし受信停止中にカーネルのソケットバッファに溜まった分は、受信を再開してrecv()した時刻になる
+#define CAPTURE_MAGIC "SOCKCAP1"
+#define CAPTURE_HDR_SIZE 17
+#define CAPTURE_OPEN 'O'
+#define CAPTURE_LINE 'L'
+#define CAPTURE_CLOSE 'C'
+
+// 受信記録ファイル(記録しない場合はNULL)
+FILE *capture_fp;
+struct timespec capture_start;
+uint32_t capture_next_id;
+
+// SIGINT/SIGTERMで記録ファイルを閉じてから終了するためのフラグ
+volatile sig_atomic_t server_quit;
 
 // サイズ指定文字列連結
 size_t mystrlcat(char *dst, const char *src, size_t size) {
@@ -39,45 +116,378 @@ size_t mystrlcat(char *dst, const char *src, size_t size) {
   return (dlen + (ps - src - 1));
 }
 
-// 送受信ループ
-void send_recv_loop(int acc) {
-  char buf[512], *ptr;
-  ssize_t len;
+// 受信記録の開始
+int capture_open(const char *path) {
+  if ((capture_fp = fopen(path, "wb")) == NULL) {
+    perror("fopen");
+    return (-1);
+  }
+  if (fwrite(CAPTURE_MAGIC, strlen(CAPTURE_MAGIC), 1, capture_fp) != 1) {
+    perror("fwrite");
+    (void) fclose(capture_fp);
+    capture_fp = NULL;
+    return (-1);
+  }
+  (void) clock_gettime(CLOCK_MONOTONIC, &capture_start);
+  return (0);
+}
 
-  for (;;) {
-    // 受信
-    if ((len = recv(acc, buf, sizeof(buf), 0)) == -1) {
-      // Error
-      perror("recv");
-      break;
+// 受信記録の終了
+void capture_close(void) {
+  if (capture_fp != NULL) {
+    (void) fclose(capture_fp);
+    capture_fp = NULL;
+  }
+}
+
+// 記録開始からの経過マイクロ秒
+uint64_t capture_usec(void) {
+  struct timespec now;
+
+  (void) clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((uint64_t) ((int64_t) (now.tv_sec - capture_start.tv_sec) * 1000000
+                      + (now.tv_nsec - capture_start.tv_nsec) / 1000));
+}
+
+// 受信記録にレコードを1つ追加
+// 書き込みに失敗したら以降の記録は止めるが、サーバの処理は続ける
+void capture_write(int type, uint32_t id, uint64_t usec, const char *data, size_t len) {
+  unsigned char hdr[CAPTURE_HDR_SIZE];
+  uint32_t n;
+
+  if (capture_fp == NULL) {
+    return;
+  }
+
+  hdr[0] = (unsigned char) type;
+  n = htonl(id);
+  (void) memcpy(hdr + 1, &n, 4);
+  n = htonl((uint32_t) (usec >> 32));
+  (void) memcpy(hdr + 5, &n, 4);
+  n = htonl((uint32_t) usec);
+  (void) memcpy(hdr + 9, &n, 4);
+  n = htonl((uint32_t) len);
+  (void) memcpy(hdr + 13, &n, 4);
+  if (fwrite(hdr, sizeof(hdr), 1, capture_fp) != 1
+      || (len > 0 && fwrite(data, len, 1, capture_fp) != 1)) {
+    perror("fwrite");
+    capture_close();
+  }
+}
+
+// 終了シグナルのハンドラ
+void sig_quit_handler(int sig) {
+  (void) sig;
+  server_quit = 1;
+}
+
+// 接続状態の作成
+struct conn *conn_new(int acc, const struct peer_cred *cred) {
+  struct conn *conn;
+
+  if ((conn = calloc(1, sizeof(*conn))) == NULL) {
+    perror("calloc");
+    return (NULL);
+  }
+  conn->acc = acc;
+  conn->id = ++capture_next_id;
+  if (cred != NULL) {
+    conn->cred = *cred;
+    conn->has_cred = 1;
+  }
+  return (conn);
+}
+
+// 接続状態の解放とクローズ
+void conn_free(struct conn *conn) {
+  struct out_buf *ob, *next;
+
+  capture_write(CAPTURE_CLOSE, conn->id, capture_usec(), NULL, 0);
+  for (ob = conn->out_head; ob != NULL; ob = next) {
+    next = ob->next;
+    free(ob);
+  }
+  (void) close(conn->acc);
+  free(conn);
+}
+
+// 出力キューの末尾に追加
+// 末尾のバッファに空きがあればそこに詰め、足りなければバッファをつなげる
+int out_queue_append(struct conn *conn, const char *data, size_t len) {
+  struct out_buf *ob;
+  size_t n;
+
+  while (len > 0) {
+    ob = conn->out_tail;
+    if (ob == NULL || ob->len == sizeof(ob->data)) {
+      if ((ob = malloc(sizeof(*ob))) == NULL) {
+        perror("malloc");
+        return (-1);
+      }
+      ob->next = NULL;
+      ob->off = 0;
+      ob->len = 0;
+      if (conn->out_tail == NULL) {
+        conn->out_head = ob;
+      } else {
+        conn->out_tail->next = ob;
+      }
+      conn->out_tail = ob;
+    }
+    n = sizeof(ob->data) - ob->len;
+    if (n > len) {
+      n = len;
     }
-    if (len == 0) {
-      // end of file
-      (void) fprintf(stderr, "recv:EOF\n");
+    (void) memcpy(ob->data + ob->len, data, n);
+    ob->len += n;
+    conn->out_len += n;
+    data += n;
+    len -= n;
+  }
+  return (0);
+}
+
+// 受信バッファから1行ずつ取り出して応答を出力キューに積む
+// HIGH_WATERを超えたら残りの行は受信再開まで処理しない
+int conn_handle_lines(struct conn *conn) {
+  char buf[sizeof(conn->in) + sizeof(":OK\r\n")], *ptr;
+  size_t len, used;
+
+  used = 0;
+  while (!conn->paused && used < conn->in_len) {
+    if ((ptr = memchr(conn->in + used, '\n', conn->in_len - used)) != NULL) {
+      len = (size_t) (ptr - (conn->in + used)) + 1;
+    } else if (used == 0 && (conn->in_len == sizeof(conn->in) || conn->eof)) {
+      // 改行のないままバッファが一杯になったか、最後の行に改行がない
+      len = conn->in_len;
+    } else {
       break;
     }
 
     // 文字列化・表示
+    (void) memcpy(buf, conn->in + used, len);
     buf[len] = '\0';
+    used += len;
+    capture_write(CAPTURE_LINE, conn->id, conn->in_usec, buf, len);
     if ((ptr = strpbrk(buf, "\r\n")) != NULL) {
       *ptr = '\0';
     }
-
-    (void) fprintf(stderr, "[client]%s\n", buf);
+    if (conn->has_cred) {
+      (void) fprintf(stderr, "[client pid=%d uid=%d]%s\n",
+                     (int) conn->cred.pid, (int) conn->cred.uid, buf);
+    } else {
+      (void) fprintf(stderr, "[client]%s\n", buf);
+    }
 
     // 応答文字列作成
     (void) mystrlcat(buf, ":OK\r\n", sizeof(buf));
-    len = (ssize_t) strlen(buf);
-    // 応答
-    if ((len = send(acc, buf, (size_t) len, 0)) == -1) {
+    if (out_queue_append(conn, buf, strlen(buf)) == -1) {
+      return (-1);
+    }
+    if (conn->out_len >= OUT_HIGH_WATER) {
+      (void) fprintf(stderr, "pause:%d:queued=%zu\n", conn->acc, conn->out_len);
+      conn->paused = 1;
+    }
+  }
+
+  // 処理済みの行を詰める
+  if (used > 0) {
+    (void) memmove(conn->in, conn->in + used, conn->in_len - used);
+    conn->in_len -= used;
+  }
+  return (0);
+}
+
+// 出力キューを送信できるだけ送信
+// 送信しきれなかった分はキューに残し、次に書き込み可能になったときに送る
+int out_queue_flush(struct conn *conn) {
+  struct out_buf *ob;
+  ssize_t len;
+
+  while ((ob = conn->out_head) != NULL) {
+    if ((len = send(conn->acc, ob->data + ob->off, ob->len - ob->off, 0)) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
       // Error
       perror("send");
+      return (-1);
+    }
+    ob->off += (size_t) len;
+    conn->out_len -= (size_t) len;
+    if (ob->off < ob->len) {
+      // 短い書き込み。残りは次回
       break;
     }
+    conn->out_head = ob->next;
+    if (conn->out_head == NULL) {
+      conn->out_tail = NULL;
+    }
+    free(ob);
   }
+
+  if (conn->paused && conn->out_len <= OUT_LOW_WATER) {
+    (void) fprintf(stderr, "resume:%d:queued=%zu\n", conn->acc, conn->out_len);
+    conn->paused = 0;
+    // 受信停止中に溜まっていた行を処理
+    return (conn_handle_lines(conn));
+  }
+  return (0);
+}
+
+// 受信して応答を出力キューに積み、送信できる分を送信
+int conn_recv(struct conn *conn) {
+  ssize_t len;
+
+  // 受信
+  if ((len = recv(conn->acc, conn->in + conn->in_len,
+                  sizeof(conn->in) - conn->in_len, 0)) == -1) {
+    if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+      return (0);
+    }
+    // Error
+    perror("recv");
+    return (-1);
+  }
+  if (len == 0) {
+    // end of file
+    (void) fprintf(stderr, "recv:EOF\n");
+    conn->eof = 1;
+  }
+  conn->in_len += (size_t) len;
+  if (capture_fp != NULL) {
+    conn->in_usec = capture_usec();
+  }
+
+  if (conn_handle_lines(conn) == -1) {
+    return (-1);
+  }
+  return (out_queue_flush(conn));
+}
+
+// UNIXドメインソケットのエンドポイント指定かどうか
+int is_unix_endpoint(const char *endpoint) {
+  return (strncmp(endpoint, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0);
+}
+
+// "unix:..." からUNIXドメインソケットのアドレスを作成
+int unix_sockaddr(const char *endpoint, struct sockaddr_un *addr, socklen_t *addr_len) {
+  const char *path;
+  size_t path_len;
+
+  path = endpoint + strlen(UNIX_PREFIX);
+  path_len = strlen(path);
+  // sun_pathに収まらないパスはエラー(終端の'\0'の分も考慮)
+  if (path_len == 0 || path_len >= sizeof(addr->sun_path)) {
+    (void) fprintf(stderr, "unix_sockaddr():invalid path:%s\n", path);
+    return (-1);
+  }
+
+  (void) memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (path[0] == '@') {
+#ifdef __linux__
+    // 抽象名前空間ではsun_pathの先頭を'\0'にし、名前の長さ分だけをアドレス長に含める
+    (void) memcpy(addr->sun_path + 1, path + 1, path_len - 1);
+    *addr_len = (socklen_t) (offsetof(struct sockaddr_un, sun_path) + path_len);
+#else
+    (void) fprintf(stderr, "unix_sockaddr():abstract namespace is not supported\n");
+    return (-1);
+#endif
+  } else {
+    (void) memcpy(addr->sun_path, path, path_len);
+    *addr_len = (socklen_t) (offsetof(struct sockaddr_un, sun_path) + path_len + 1);
+  }
+  return (0);
+}
+
+// Ready for UNIX domain server_socket
+int server_socket_unix(const char *endpoint) {
+  struct sockaddr_un addr;
+  struct stat st;
+  socklen_t addr_len;
+  int soc, probe, err;
+
+  if (unix_sockaddr(endpoint, &addr, &addr_len) == -1) {
+    return (-1);
+  }
+  (void) fprintf(stderr, "path=%s\n", endpoint + strlen(UNIX_PREFIX));
+
+  // Create socket
+  if ((soc = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+    perror("socket");
+    return (-1);
+  }
+
+  // UNIXドメインソケットにはSO_REUSEADDRが効かないので、前回の実行で残ったソケットファイルを削除する
+  // ソケット以外のファイルは誤って消さないようにbind()のエラーにまかせる
+  // 待ち受け中のサーバがいるかはconnect()して確かめ、ECONNREFUSEDの場合だけ残骸として削除する
+  if (addr.sun_path[0] != '\0'
+      && lstat(addr.sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    if ((probe = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+      perror("socket");
+      (void) close(soc);
+      return (-1);
+    }
+    if (connect(probe, (struct sockaddr *) &addr, addr_len) == 0) {
+      (void) fprintf(stderr, "bind:%s:Address already in use\n", addr.sun_path);
+      (void) close(probe);
+      (void) close(soc);
+      return (-1);
+    }
+    err = errno;
+    (void) close(probe);
+    if (err == ECONNREFUSED) {
+      (void) unlink(addr.sun_path);
+    }
+  }
+
+  // bind address to socket
+  if (bind(soc, (struct sockaddr *) &addr, addr_len) == -1) {
+    perror("bind");
+    (void) close(soc);
+    return (-1);
+  }
+
+  // Set access backlog
+  if (listen(soc, SOMAXCONN) == -1) {
+    perror("listen");
+    (void) close(soc);
+    return (-1);
+  }
+  return (soc);
+}
+
+// 接続元の資格情報を取得
+// LinuxではSO_PEERCRED、BSD系ではgetpeereid()を使う(pidは取得できない)
+int get_peer_cred(int acc, struct peer_cred *cred) {
+#ifdef SO_PEERCRED
+  struct ucred uc;
+  socklen_t uc_len;
+
+  uc_len = (socklen_t) sizeof(uc);
+  if (getsockopt(acc, SOL_SOCKET, SO_PEERCRED, &uc, &uc_len) == -1) {
+    perror("getsockopt");
+    return (-1);
+  }
+  cred->pid = uc.pid;
+  cred->uid = uc.uid;
+  cred->gid = uc.gid;
+#else
+  if (getpeereid(acc, &cred->uid, &cred->gid) == -1) {
+    perror("getpeereid");
+    return (-1);
+  }
+  cred->pid = -1;
+#endif
+  return (0);
 }
 
 // Ready for server_socket
+// portnmが "unix:..." の場合はUNIXドメインソケットで待ち受ける
 int server_socket(const char *portnm) {
   fprintf(stderr, "server_socket");
   char nbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
@@ -85,6 +495,10 @@ int server_socket(const char *portnm) {
   int soc, opt, errcode;
   socklen_t opt_len;
 
+  if (is_unix_endpoint(portnm)) {
+    return (server_socket_unix(portnm));
+  }
+
   // Reset addrinfo
   (void) memset(&hints, 0, sizeof(hints));
   hints.ai_family = AF_INET;
@@ -151,51 +565,172 @@ int server_socket(const char *portnm) {
   return (soc);
 }
 
-// accept loop
-// 並列処理を行っていないので、受け付けた後、1つのクライアントの送受信処理が終わるまで他の受付ができない。
-void accept_loop(int soc) {
+// 接続受付
+// 受け付けたディスクリプタはノンブロッキングにして接続テーブルに登録する
+// ディスクリプタが尽きて受け付けられない場合は-1を返す
+int accept_conn(int soc) {
   char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
   struct sockaddr_storage from;
-  int acc;
+  struct peer_cred cred, *credp;
+  struct conn *conn;
+  int acc, flags;
   socklen_t len;
 
+  len = (socklen_t) sizeof(from);
+  if ((acc = accept(soc, (struct sockaddr *) &from, &len)) == -1) {
+    if (errno == EMFILE || errno == ENFILE) {
+      perror("accept");
+      return (-1);
+    }
+    if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+      perror("accept");
+    }
+    return (0);
+  }
+  if (acc >= FD_SETSIZE) {
+    (void) fprintf(stderr, "accept:too many connections\n");
+    (void) close(acc);
+    return (0);
+  }
 
-  for (;;) {
-    len = (socklen_t) sizeof(from);
+  credp = NULL;
+  if (from.ss_family == AF_UNIX) {
+    // UNIXドメインソケットではホスト名・ポートの代わりに接続元プロセスの資格情報を表示
+    if (get_peer_cred(acc, &cred) == 0) {
+      credp = &cred;
+      (void) fprintf(stderr, "accept:unix:pid=%d uid=%d gid=%d\n",
+                     (int) cred.pid, (int) cred.uid, (int) cred.gid);
+    } else {
+      (void) fprintf(stderr, "accept:unix\n");
+    }
+  } else {
+    (void) getnameinfo((struct sockaddr *) &from, len,
+                        hbuf, sizeof(hbuf),
+                        sbuf, sizeof(sbuf),
+                        NI_NUMERICHOST | NI_NUMERICSERV);
+    (void) fprintf(stderr, "accept:%s:%s\n", hbuf, sbuf);
+  }
 
-    // waiting connection
-    // 1つも待ちがない状態だとaccept()実行でブロックする
+  // 遅いクライアントへのsend()で他のクライアントが待たされないようにノンブロッキングにする
+  if ((flags = fcntl(acc, F_GETFL, 0)) == -1
+      || fcntl(acc, F_SETFL, flags | O_NONBLOCK) == -1) {
+    perror("fcntl");
+    (void) close(acc);
+    return (0);
+  }
+  if ((conn = conn_new(acc, credp)) == NULL) {
+    (void) close(acc);
+    return (0);
+  }
+  conn_tbl[acc] = conn;
+  capture_write(CAPTURE_OPEN, conn->id, capture_usec(), NULL, 0);
+  return (0);
+}
+
+// accept loop
+// pselect()で受付と全クライアントの送受信を多重化する
+// 出力キューが溜まっているクライアントは書き込み可能を待ち、受信停止中のクライアントは読み込みを待たない
+// ディスクリプタが尽きたら、接続がクローズされるか1秒経つまで受付を止める
+// (待ち受けソケットは読み込み可能のままなので、止めないとaccept()の失敗を繰り返し続ける)
+void accept_loop(int soc) {
+  struct conn *conn;
+  struct timespec timeout;
+  sigset_t quit_mask, orig_mask;
+  fd_set rmask, wmask;
+  int width, i, err, flags, accept_paused;
+
+  // pselect()後にクライアントが接続を取りやめてもaccept()でブロックしないようにする
+  if ((flags = fcntl(soc, F_GETFL, 0)) == -1
+      || fcntl(soc, F_SETFL, flags | O_NONBLOCK) == -1) {
+    perror("fcntl");
+    return;
+  }
 
-    // ここでsocが０になっている
-    acc = accept(soc, (struct sockaddr *) &from, &len);
-    (void) fprintf(stderr, "before0 %d %d", acc, soc);
-    if (acc == -1) {
-          (void) fprintf(stderr, "before1 %d \n", errno);
-      if (errno != EINTR) {
-        perror("accept");
+  // SIGINT/SIGTERMはpselect()で待っている間だけ受け取る
+  // server_quitを確認してからselect()でブロックするまでの間に届くと、次のイベントまで終了できないため
+  (void) sigemptyset(&quit_mask);
+  (void) sigaddset(&quit_mask, SIGINT);
+  (void) sigaddset(&quit_mask, SIGTERM);
+  (void) sigprocmask(SIG_BLOCK, &quit_mask, &orig_mask);
+
+  accept_paused = 0;
+  while (!server_quit) {
+    // pselect()用マスクを毎回作り直す
+    FD_ZERO(&rmask);
+    FD_ZERO(&wmask);
+    if (!accept_paused) {
+      FD_SET(soc, &rmask);
+    }
+    width = soc + 1;
+    for (i = 0; i < FD_SETSIZE; i++) {
+      if ((conn = conn_tbl[i]) == NULL) {
+        continue;
       }
-    } else {
-            (void) fprintf(stderr, "test1");
-      (void) getnameinfo((struct sockaddr *) &from, len,
-                          hbuf, sizeof(hbuf),
-                          sbuf, sizeof(sbuf),
-                          NI_NUMERICHOST | NI_NUMERICSERV);
-      (void) fprintf(stderr, "acceptｎ:%s:%s\n", hbuf, sbuf);
+      if (!conn->paused && !conn->eof) {
+        FD_SET(i, &rmask);
+      }
+      if (conn->out_len > 0) {
+        FD_SET(i, &wmask);
+      }
+      if (i + 1 > width) {
+        width = i + 1;
+      }
+    }
+
+    timeout.tv_sec = 1;
+    timeout.tv_nsec = 0;
+    switch (pselect(width, &rmask, &wmask, NULL, accept_paused ? &timeout : NULL, &orig_mask)) {
+      case -1:
+        if (errno != EINTR) {
+          perror("pselect");
+        }
+        continue;
+      case 0:
+        // timeout: 受付を再開してみる
+        accept_paused = 0;
+        continue;
+    }
+
+    if (FD_ISSET(soc, &rmask) && accept_conn(soc) == -1) {
+      accept_paused = 1;
+    }
+    for (i = 0; i < FD_SETSIZE; i++) {
+      if ((conn = conn_tbl[i]) == NULL || i == soc) {
+        continue;
+      }
+      err = 0;
+      if (FD_ISSET(i, &wmask)) {
+        err = out_queue_flush(conn);
+      }
+      if (err == 0 && FD_ISSET(i, &rmask)) {
+        err = conn_recv(conn);
+      }
+      // エラー、または送信を終えたクライアントへの応答を送り切ったらクローズ
+      if (err == -1 || (conn->eof && conn->out_len == 0)) {
+        conn_free(conn);
+        conn_tbl[i] = NULL;
+        accept_paused = 0;
+      }
+    }
+  }
 
-      // loop
-      (void) send_recv_loop(acc);
-      // close
-      (void) close(acc);
-      acc = 0;
+  // 終了時は残っている接続をクローズ(受信記録に切断を残す)
+  for (i = 0; i < FD_SETSIZE; i++) {
+    if (conn_tbl[i] != NULL) {
+      conn_free(conn_tbl[i]);
+      conn_tbl[i] = NULL;
     }
   }
+  (void) sigprocmask(SIG_SETMASK, &orig_mask, (sigset_t *) NULL);
 }
 
 int main(int argc, char *argv[]) {
+  struct sigaction sa;
   int soc = 0;
   // check if port num is set to args
+  // 2番目の引数があれば受信した行をそのファイルに記録する
   if (argc <= 1) {
-    (void) fprintf(stderr, "server port\n");
+    (void) fprintf(stderr, "server port|unix:/path|unix:@name [capture-file]\n");
     return (EX_USAGE);
   }
 
@@ -204,10 +739,30 @@ int main(int argc, char *argv[]) {
   if ((soc = server_socket(argv[1])) == -1) { (void) fprintf(stderr, "server_socket(%s):error\n", argv[1]);
     return (EX_UNAVAILABLE);
   }
+  if (argc > 2 && capture_open(argv[2]) == -1) {
+    (void) fprintf(stderr, "capture_open(%s):error\n", argv[2]);
+    (void) close(soc);
+    return (EX_CANTCREAT);
+  }
+
+  // 切断済みのクライアントへのsend()でSIGPIPEによって終了しないようにする
+  (void) signal(SIGPIPE, SIG_IGN);
+  // SIGINT/SIGTERMではpselect()を中断してaccept_loop()から抜ける
+  (void) memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = sig_quit_handler;
+  (void) sigemptyset(&sa.sa_mask);
+  (void) sigaction(SIGINT, &sa, (struct sigaction *) NULL);
+  (void) sigaction(SIGTERM, &sa, (struct sigaction *) NULL);
+
   (void) fprintf(stderr, "ready for accept\n");
   // accept loop
   accept_loop(soc);
-  // close server_socket
+  // close capture file and server_socket
+  capture_close();
   (void) close(soc);
+  // 作成したソケットファイルを削除(抽象名前空間はファイルを作らない)
+  if (is_unix_endpoint(argv[1]) && argv[1][strlen(UNIX_PREFIX)] != '@') {
+    (void) unlink(argv[1] + strlen(UNIX_PREFIX));
+  }
   return (EX_OK);
 }
@@ -1,6 +1,11 @@
+// struct ucred(SO_PEERCRED)を使うため
+#define _GNU_SOURCE
+
 #include <sys/param.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
 #include <arpa/inet.h>
@@ -10,12 +15,23 @@
 #include <ctype.h>
 #include <errno.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
 #include <unistd.h>
 
+// UNIXドメインソケットのエンドポイント指定の接頭辞
+// "unix:/path" はファイルシステム上のパス、"unix:@name" はLinuxの抽象名前空間
+#define UNIX_PREFIX "unix:"
+
+// 接続元の資格情報(UNIXドメインソケットのみ取得可能)
+struct peer_cred {
+  pid_t pid;
+  uid_t uid;
+  gid_t gid;
+};
 
 // サイズ指定文字列連結
 size_t mystrlcat(char *dst, const char *src, size_t size) {
@@ -41,7 +57,8 @@ size_t mystrlcat(char *dst, const char *src, size_t size) {
 }
 
 // 送受信ループ
-void send_recv_loop(int acc) {
+// credはUNIXドメインソケットで接続元の資格情報が取れた場合のみ非NULL
+void send_recv_loop(int acc, const struct peer_cred *cred) {
   char buf[512], *ptr;
   ssize_t len;
 
@@ -64,7 +81,12 @@ void send_recv_loop(int acc) {
       *ptr = '\0';
     }
 
-    (void) fprintf(stderr, "[client]%s\n", buf);
+    if (cred != NULL) {
+      (void) fprintf(stderr, "[client pid=%d uid=%d]%s\n",
+                     (int) cred->pid, (int) cred->uid, buf);
+    } else {
+      (void) fprintf(stderr, "[client]%s\n", buf);
+    }
 
     // 応答文字列作成
     (void) mystrlcat(buf, ":OK\r\n", sizeof(buf));
@@ -78,9 +100,128 @@ void send_recv_loop(int acc) {
   }
 }
 
+// UNIXドメインソケットのエンドポイント指定かどうか
+int is_unix_endpoint(const char *endpoint) {
+  return (strncmp(endpoint, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0);
+}
+
+// "unix:..." からUNIXドメインソケットのアドレスを作成
+int unix_sockaddr(const char *endpoint, struct sockaddr_un *addr, socklen_t *addr_len) {
+  const char *path;
+  size_t path_len;
+
+  path = endpoint + strlen(UNIX_PREFIX);
+  path_len = strlen(path);
+  // sun_pathに収まらないパスはエラー(終端の'\0'の分も考慮)
+  if (path_len == 0 || path_len >= sizeof(addr->sun_path)) {
+    (void) fprintf(stderr, "unix_sockaddr():invalid path:%s\n", path);
+    return (-1);
+  }
+
+  (void) memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (path[0] == '@') {
+#ifdef __linux__
+    // 抽象名前空間ではsun_pathの先頭を'\0'にし、名前の長さ分だけをアドレス長に含める
+    (void) memcpy(addr->sun_path + 1, path + 1, path_len - 1);
+    *addr_len = (socklen_t) (offsetof(struct sockaddr_un, sun_path) + path_len);
+#else
+    (void) fprintf(stderr, "unix_sockaddr():abstract namespace is not supported\n");
+    return (-1);
+#endif
+  } else {
+    (void) memcpy(addr->sun_path, path, path_len);
+    *addr_len = (socklen_t) (offsetof(struct sockaddr_un, sun_path) + path_len + 1);
+  }
+  return (0);
+}
+
+// Ready for UNIX domain server_socket
+int server_socket_unix(const char *endpoint) {
+  struct sockaddr_un addr;
+  struct stat st;
+  socklen_t addr_len;
+  int soc, probe, err;
+
+  if (unix_sockaddr(endpoint, &addr, &addr_len) == -1) {
+    return (-1);
+  }
+  (void) fprintf(stderr, "path=%s\n", endpoint + strlen(UNIX_PREFIX));
+
+  // Create socket
+  if ((soc = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+    perror("socket");
+    return (-1);
+  }
+
+  // UNIXドメインソケットにはSO_REUSEADDRが効かないので、前回の実行で残ったソケットファイルを削除する
+  // ソケット以外のファイルは誤って消さないようにbind()のエラーにまかせる
+  // 待ち受け中のサーバがいるかはconnect()して確かめ、ECONNREFUSEDの場合だけ残骸として削除する
+  if (addr.sun_path[0] != '\0'
+      && lstat(addr.sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    if ((probe = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+      perror("socket");
+      (void) close(soc);
+      return (-1);
+    }
+    if (connect(probe, (struct sockaddr *) &addr, addr_len) == 0) {
+      (void) fprintf(stderr, "bind:%s:Address already in use\n", addr.sun_path);
+      (void) close(probe);
+      (void) close(soc);
+      return (-1);
+    }
+    err = errno;
+    (void) close(probe);
+    if (err == ECONNREFUSED) {
+      (void) unlink(addr.sun_path);
+    }
+  }
+
+  // bind address to socket
+  if (bind(soc, (struct sockaddr *) &addr, addr_len) == -1) {
+    perror("bind");
+    (void) close(soc);
+    return (-1);
+  }
+
+  // Set access backlog
+  if (listen(soc, SOMAXCONN) == -1) {
+    perror("listen");
+    (void) close(soc);
+    return (-1);
+  }
+  return (soc);
+}
+
+// 接続元の資格情報を取得
+// LinuxではSO_PEERCRED、BSD系ではgetpeereid()を使う(pidは取得できない)
+int get_peer_cred(int acc, struct peer_cred *cred) {
+#ifdef SO_PEERCRED
+  struct ucred uc;
+  socklen_t uc_len;
+
+  uc_len = (socklen_t) sizeof(uc);
+  if (getsockopt(acc, SOL_SOCKET, SO_PEERCRED, &uc, &uc_len) == -1) {
+    perror("getsockopt");
+    return (-1);
+  }
+  cred->pid = uc.pid;
+  cred->uid = uc.uid;
+  cred->gid = uc.gid;
+#else
+  if (getpeereid(acc, &cred->uid, &cred->gid) == -1) {
+    perror("getpeereid");
+    return (-1);
+  }
+  cred->pid = -1;
+#endif
+  return (0);
+}
+
 // Ready for server_socket
 // chapter1と異なり、引数でホスト名またはIPアドレスを渡し、そのアドレスをbind()で
 // バインドするように変更する
+// hostnmが "unix:..." の場合はUNIXドメインソケットで待ち受ける(portnmは使わない)
 int server_socket_by_hostname(const char *hostnm, const char *portnm) {
 
   char nbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
@@ -88,6 +229,10 @@ int server_socket_by_hostname(const char *hostnm, const char *portnm) {
   int soc, opt, errcode;
   socklen_t opt_len;
 
+  if (is_unix_endpoint(hostnm)) {
+    return (server_socket_unix(hostnm));
+  }
+
   // Reset addrinfo
   (void) memset(&hints, 0, sizeof(hints));
   hints.ai_family = AF_INET;
@@ -159,6 +304,7 @@ int server_socket_by_hostname(const char *hostnm, const char *portnm) {
 void accept_loop(int soc) {
   char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
   struct sockaddr_storage from;
+  struct peer_cred cred, *credp;
   int acc;
   socklen_t len;
 
@@ -179,14 +325,26 @@ void accept_loop(int soc) {
       }
     } else {
             (void) fprintf(stderr, "test1");
-      (void) getnameinfo((struct sockaddr *) &from, len,
-                          hbuf, sizeof(hbuf),
-                          sbuf, sizeof(sbuf),
-                          NI_NUMERICHOST | NI_NUMERICSERV);
-      (void) fprintf(stderr, "acceptｎ:%s:%s\n", hbuf, sbuf);
+      credp = NULL;
+      if (from.ss_family == AF_UNIX) {
+        // UNIXドメインソケットではホスト名・ポートの代わりに接続元プロセスの資格情報を表示
+        if (get_peer_cred(acc, &cred) == 0) {
+          credp = &cred;
+          (void) fprintf(stderr, "accept:unix:pid=%d uid=%d gid=%d\n",
+                         (int) cred.pid, (int) cred.uid, (int) cred.gid);
+        } else {
+          (void) fprintf(stderr, "accept:unix\n");
+        }
+      } else {
+        (void) getnameinfo((struct sockaddr *) &from, len,
+                            hbuf, sizeof(hbuf),
+                            sbuf, sizeof(sbuf),
+                            NI_NUMERICHOST | NI_NUMERICSERV);
+        (void) fprintf(stderr, "acceptｎ:%s:%s\n", hbuf, sbuf);
+      }
 
       // loop
-      (void) send_recv_loop(acc);
+      (void) send_recv_loop(acc, credp);
       // close
       (void) close(acc);
       acc = 0;
@@ -197,13 +355,14 @@ void accept_loop(int soc) {
 int main(int argc, char *argv[]) {
   int soc = 0;
   // check if port num and ip address are set to args
-  if (argc <= 2) {
-    (void) fprintf(stderr, "server port\n");
+  // UNIXドメインソケットの場合はパスのみ指定する
+  if (argc <= 1 || (argc <= 2 && !is_unix_endpoint(argv[1]))) {
+    (void) fprintf(stderr, "server host port|unix:/path|unix:@name\n");
     return (EX_USAGE);
   }
 
   // Prepare for making server_socket
-  if ((soc = server_socket_by_hostname(argv[1], argv[2])) == -1) { (void) fprintf(stderr, "server_socket(%s, %s):error\n", argv[1], argv[2]);
+  if ((soc = server_socket_by_hostname(argv[1], argc > 2 ? argv[2] : "")) == -1) { (void) fprintf(stderr, "server_socket(%s, %s):error\n", argv[1], argc > 2 ? argv[2] : "");
     return (EX_UNAVAILABLE);
   }
   (void) fprintf(stderr, "ready for accept\n");